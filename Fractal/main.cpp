@@ -1,13 +1,45 @@
 #define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
 #include <Windows.h>
 #include <d3d11.h>
 #include <d3dcompiler.h>
+#include <malloc.h>
+#include <new>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <string>
 
 #pragma comment(lib, "d3d11.lib")
 #pragma comment(lib, "d3dcompiler.lib")
 
 constexpr auto SCREEN_WIDTH = 900;
 constexpr auto SCREEN_HEIGHT = 720;
+constexpr auto TILE_SIZE = 32;
+constexpr auto COST_SAMPLES = 4;
+constexpr auto FRAME_BUDGET = 33.0;
+constexpr auto MAX_PREVIEW_STEP = 8;
+constexpr auto DENSITY_GRID = 256;
+constexpr auto DENSITY_CHUNK = 1024;
+constexpr auto DENSITY_SAMPLE_RADIUS = 2.0;
+constexpr auto DENSITY_UNIFORM_SHARE = 0.1;
+constexpr auto DENSITY_DISPLAY_INTERVAL = 250.0;
+constexpr auto DENSITY_TIME_LIMIT = 60000.0;
+constexpr auto WM_UPDATE_TITLE = WM_APP + 1;
+constexpr auto NO_RENDER_TARGET = ~0u;
+constexpr auto ORBIT_VALIDITY = 4.0;
+constexpr auto ORBIT_CACHE_MEMORY = (SIZE_T)256 << 20;
+constexpr auto ORBIT_CACHE_ENTRIES = 64;
+constexpr auto ORBIT_MAX_LENGTH = (UINT64)1 << 22;
+constexpr auto ORBIT_CHUNK = 1u << 16;
 
 #pragma region Shader codes
 
@@ -156,6 +188,16 @@ for (i = 0.0; i < iterCount; i++)\
 }\
 return IterationsToColor(i / iterCount);\
 }";
+LPCSTR g_psCodeTexture = "\
+Texture2D frame;\
+struct PIT\
+{\
+	float4 p:SV_POSITION;\
+	float2 t:TEXCOORD;\
+};\
+float4 main(PIT input):SV_TARGET{\
+return frame.Load(int3(input.p.xy, 0));\
+}";
 
 #pragma endregion
 
@@ -172,106 +214,1536 @@ public:
 	~AutoReleasePtr() { Release(); }
 	void Release()
 	{
-		if (m_ptr)
+		if (m_ptr)
+		{
+			m_ptr->Release();
+			m_ptr = nullptr;
+		}
+	}
+	T* get() const { return m_ptr; }
+	T* getAddress() const { return &m_ptr; }
+	operator T*() const { return m_ptr; }
+	operator bool() const { return m_ptr != nullptr; }
+	T* operator->() const { return m_ptr; }
+	T** operator&() { return &m_ptr; }
+	T* operator=(T* ptr) { return m_ptr = ptr; }
+	T* operator=(AutoReleasePtr& ptr)
+	{
+		m_ptr = ptr.m_ptr;
+		ptr.m_ptr = nullptr;
+		return m_ptr;
+	}
+	bool operator==(T* ptr) const { return m_ptr == ptr; }
+	bool operator!=(T* ptr) const { return m_ptr != ptr; }
+};
+
+struct Graphics
+{
+	AutoReleasePtr<ID3D11Device> device;
+	AutoReleasePtr<ID3D11DeviceContext> deviceContext;
+	AutoReleasePtr<IDXGISwapChain> swapChain;
+	AutoReleasePtr<ID3D11RenderTargetView> renderTargetView;
+	AutoReleasePtr<ID3D11Texture2D> depthStencilBuffer;
+	AutoReleasePtr<ID3D11DepthStencilView> depthStencilView;
+	AutoReleasePtr<ID3D11DepthStencilState> depthStencilState;
+	AutoReleasePtr<ID3D11RasterizerState> rasterizerState;
+
+	AutoReleasePtr<ID3D11VertexShader> vertexShader;
+	AutoReleasePtr<ID3D11PixelShader> psFloat;
+	AutoReleasePtr<ID3D11PixelShader> psDouble;
+	AutoReleasePtr<ID3D11Buffer> vertexBuffer;
+	AutoReleasePtr<ID3D11InputLayout> inputLayout;
+	AutoReleasePtr<ID3D11Buffer> cbFloat;
+	AutoReleasePtr<ID3D11Buffer> cbDouble;
+	AutoReleasePtr<ID3D11PixelShader> psTexture;
+	AutoReleasePtr<ID3D11Texture2D> frameTexture;
+	AutoReleasePtr<ID3D11ShaderResourceView> frameView;
+};
+
+#pragma region CPU kernels
+
+template <typename T>
+inline T EscapeTime(T zx, T zy, T cx, T cy, T iterCount)
+{
+	T i, tmp;
+	for (i = 0; i < iterCount; i++)
+	{
+		tmp = zx * zx - zy * zy;
+		zy = 2 * zx * zy + cy;
+		zx = tmp + cx;
+		if (zx * zx + zy * zy > 4)
+			break;
+	}
+	return i;
+}
+
+inline UINT32 IterationsToColor(float r)
+{
+	float R = fabsf(r * 6 - 3) - 1;
+	float G = 2 - fabsf(r * 6 - 2);
+	float B = 2 - fabsf(r * 6 - 4);
+	float brightness = 1.0f - R * 0.49f;
+	auto channel = [brightness](float c)
+	{
+		c = std::min(std::max(c, 0.0f), 1.0f) * brightness;
+		return (UINT32)(std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+	};
+	return channel(B) | channel(G) << 8 | channel(R) << 16 | channel(1.0f) << 24;
+}
+
+#pragma endregion
+
+template <typename T>
+struct FractalData
+{
+	T center[2];
+	T aspectRatio[2];
+	T offset[2];
+	T zoom;
+	T iterCount;
+
+public:
+	inline FractalData()
+	{
+		SetToDefault();
+	}
+	inline void SetToDefault()
+	{
+		center[0] = 0;
+		center[1] = 0;
+		aspectRatio[0] = (T)SCREEN_WIDTH / (T)SCREEN_HEIGHT;
+		aspectRatio[1] = 1;
+		offset[0] = 0;
+		offset[1] = 0;
+		zoom = 1;
+		iterCount = 256;
+	}
+	inline void Zoom(T z)
+	{
+		zoom *= z;
+	}
+	inline void MulIterCount(T i)
+	{
+		iterCount *= i;
+	}
+	inline void Move(short dx, short dy)
+	{
+		center[0] -= dx / zoom * aspectRatio[0] / SCREEN_WIDTH * 2;
+		center[1] += dy / zoom * aspectRatio[1] / SCREEN_HEIGHT * 2;
+	}
+	inline void setCenter(short x, short y)
+	{
+		center[0] = (x / (T)SCREEN_WIDTH * 2 - 1) / zoom * aspectRatio[0] + center[0];
+		center[1] = (-y / (T)SCREEN_HEIGHT * 2 + 1) / zoom * aspectRatio[1] + center[1];
+	}
+	inline void setOffset(short x, short y)
+	{
+		offset[0] = (x / (T)SCREEN_WIDTH * 2 - 1) / zoom * aspectRatio[0] + center[0];
+		offset[1] = (-y / (T)SCREEN_HEIGHT * 2 + 1) / zoom * aspectRatio[1] + center[1];
+	}
+	inline T Iterate(bool isMandelbrot, int x, int y) const
+	{
+		T cx = (((x + (T)0.5) / SCREEN_WIDTH * 2 - 1) * aspectRatio[0]) / zoom + center[0];
+		T cy = ((1 - (y + (T)0.5) / SCREEN_HEIGHT * 2) * aspectRatio[1]) / zoom + center[1];
+		if (isMandelbrot)
+			return EscapeTime<T>(0, 0, cx, cy, iterCount);
+		return EscapeTime<T>(cx, cy, offset[0], offset[1], iterCount);
+	}
+};
+
+#pragma region Tile scheduler
+
+struct RenderTile
+{
+	int left;
+	int top;
+	int right;
+	int bottom;
+	float cost;
+	unsigned node;
+};
+
+struct SchedulerStats
+{
+	double frameTime;
+	double imbalance;
+	unsigned steals;
+	unsigned workers;
+	unsigned nodes;
+};
+
+class WorkerPool
+{
+	std::vector<std::thread> m_threads;
+	std::vector<unsigned> m_workerNodes;
+	std::vector<USHORT> m_nodeNumbers;
+	std::mutex m_runMutex;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+	const std::function<void(unsigned)>* m_task;
+	unsigned m_generation;
+	unsigned m_running;
+	bool m_quit;
+
+private:
+	void WorkerLoop(unsigned worker, GROUP_AFFINITY affinity)
+	{
+		if (affinity.Mask)
+			SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL);
+		unsigned generation = 0;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			m_wake.wait(lock, [&] { return m_quit || m_generation != generation; });
+			if (m_quit)
+				return;
+			generation = m_generation;
+			const std::function<void(unsigned)>& task = *m_task;
+			lock.unlock();
+			task(worker);
+			lock.lock();
+			if (--m_running == 0)
+				m_done.notify_one();
+		}
+	}
+	void AddWorker(unsigned nodeIndex, const GROUP_AFFINITY& affinity)
+	{
+		m_workerNodes.push_back(nodeIndex);
+		m_threads.push_back(std::thread(&WorkerPool::WorkerLoop, this, (unsigned)m_threads.size(), affinity));
+	}
+
+public:
+	WorkerPool() :m_task(nullptr), m_generation(0), m_running(0), m_quit(false) {}
+	~WorkerPool() { Stop(); }
+
+	void Start()
+	{
+		// One worker per logical processor, each restricted to the processors of its NUMA node
+		ULONG highestNode = 0;
+		if (GetNumaHighestNodeNumber(&highestNode))
+		{
+			for (ULONG node = 0; node <= highestNode; node++)
+			{
+				GROUP_AFFINITY affinity{};
+				if (!GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) || !affinity.Mask)
+					continue;
+				unsigned nodeIndex = (unsigned)m_nodeNumbers.size();
+				m_nodeNumbers.push_back((USHORT)node);
+				for (KAFFINITY mask = affinity.Mask; mask; mask &= mask - 1)
+					AddWorker(nodeIndex, affinity);
+			}
+		}
+		if (m_threads.empty())
+		{
+			GROUP_AFFINITY anyProcessor{};
+			m_nodeNumbers.push_back(0);
+			for (unsigned i = 0; i < std::max(std::thread::hardware_concurrency(), 1u); i++)
+				AddWorker(0, anyProcessor);
+		}
+	}
+	void Stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_wake.notify_all();
+		for (std::thread& thread : m_threads)
+			thread.join();
+		m_threads.clear();
+		m_workerNodes.clear();
+		m_nodeNumbers.clear();
+		m_quit = false;
+	}
+	void Run(const std::function<void(unsigned)>& task)
+	{
+		std::lock_guard<std::mutex> runLock(m_runMutex);
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_task = &task;
+		m_running = (unsigned)m_threads.size();
+		m_generation++;
+		m_wake.notify_all();
+		m_done.wait(lock, [this] { return m_running == 0; });
+		m_task = nullptr;
+	}
+
+	unsigned getWorkerCount() const
+	{
+		return (unsigned)m_threads.size();
+	}
+	unsigned getWorkerNode(unsigned worker) const
+	{
+		return m_workerNodes[worker];
+	}
+	unsigned getNodeCount() const
+	{
+		return (unsigned)m_nodeNumbers.size();
+	}
+	USHORT getNodeNumber(unsigned nodeIndex) const
+	{
+		return m_nodeNumbers[nodeIndex];
+	}
+};
+
+class NodeLocalBuffer
+{
+	void* m_data;
+
+public:
+	NodeLocalBuffer() :m_data(nullptr) {}
+	NodeLocalBuffer(const NodeLocalBuffer&) = delete;
+	NodeLocalBuffer& operator=(const NodeLocalBuffer&) = delete;
+	~NodeLocalBuffer() { Free(); }
+	bool Allocate(SIZE_T size, USHORT node)
+	{
+		Free();
+		m_data = VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+		if (!m_data)
+			m_data = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		return m_data != nullptr;
+	}
+	void Free()
+	{
+		if (m_data)
+		{
+			VirtualFree(m_data, 0, MEM_RELEASE);
+			m_data = nullptr;
+		}
+	}
+	template <typename T>
+	T* get() const { return (T*)m_data; }
+};
+
+class TileScheduler
+{
+	// Thieves hammer head, read tiles and leave the owner's counters alone, so each group gets its own cache line
+	struct alignas(64) WorkerQueue
+	{
+		std::atomic<unsigned> head;
+		alignas(64) std::vector<unsigned> tiles;
+		std::vector<unsigned> victims;
+		alignas(64) double predicted;
+		double busyTime;
+		unsigned steals;
+	};
+
+	WorkerPool& m_pool;
+	std::vector<RenderTile> m_tiles;
+	std::vector<unsigned> m_order;
+	WorkerQueue* m_queues;
+	unsigned m_queueCount;
+	std::unique_ptr<NodeLocalBuffer[]> m_nodeFrames;
+	SchedulerStats m_stats;
+	double m_ticksPerMs;
+
+private:
+	bool Init()
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		m_ticksPerMs = (double)frequency.QuadPart / 1000.0;
+
+		for (int top = 0; top < SCREEN_HEIGHT; top += TILE_SIZE)
+			for (int left = 0; left < SCREEN_WIDTH; left += TILE_SIZE)
+				m_tiles.push_back({ left, top, std::min(left + TILE_SIZE, SCREEN_WIDTH), std::min(top + TILE_SIZE, SCREEN_HEIGHT), 0.0f, 0 });
+		m_order.resize(m_tiles.size());
+
+		m_nodeFrames.reset(new NodeLocalBuffer[m_pool.getNodeCount()]);
+		for (unsigned n = 0; n < m_pool.getNodeCount(); n++)
+			if (!m_nodeFrames[n].Allocate(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(UINT32), m_pool.getNodeNumber(n)))
+			{
+				m_tiles.clear();
+				return false;
+			}
+
+		unsigned workerCount = m_pool.getWorkerCount();
+		m_queues = (WorkerQueue*)_aligned_malloc(workerCount * sizeof(WorkerQueue), alignof(WorkerQueue));
+		if (!m_queues)
+		{
+			m_tiles.clear();
+			return false;
+		}
+		for (m_queueCount = 0; m_queueCount < workerCount; m_queueCount++)
+			new (&m_queues[m_queueCount]) WorkerQueue();
+		for (unsigned w = 0; w < workerCount; w++)
+		{
+			// Steal from workers of the same node first, starting at the next neighbour to spread thieves
+			for (int pass = 0; pass < 2; pass++)
+				for (unsigned i = 1; i < workerCount; i++)
+				{
+					unsigned victim = (w + i) % workerCount;
+					if ((m_pool.getWorkerNode(victim) == m_pool.getWorkerNode(w)) == (pass == 0))
+						m_queues[w].victims.push_back(victim);
+				}
+		}
+		return true;
+	}
+
+	void EstimateCosts(const std::function<float(int, int)>& iterations)
+	{
+		// Cheap low resolution pre-pass: a few samples per tile predict how long the full tile takes
+		std::atomic<unsigned> next(0);
+		m_pool.Run([&](unsigned)
+		{
+			for (unsigned t; (t = next++) < m_tiles.size();)
+			{
+				RenderTile& tile = m_tiles[t];
+				float sum = 0.0f;
+				for (int sy = 0; sy < COST_SAMPLES; sy++)
+					for (int sx = 0; sx < COST_SAMPLES; sx++)
+						sum += iterations(tile.left + (tile.right - tile.left) * (2 * sx + 1) / (2 * COST_SAMPLES),
+							tile.top + (tile.bottom - tile.top) * (2 * sy + 1) / (2 * COST_SAMPLES)) + 1.0f;
+				tile.cost = sum * (tile.right - tile.left) * (tile.bottom - tile.top) / (COST_SAMPLES * COST_SAMPLES);
+			}
+		});
+	}
+
+	void Schedule()
+	{
+		// Longest predicted tile first, each one to the least loaded worker
+		for (unsigned t = 0; t < m_order.size(); t++)
+			m_order[t] = t;
+		std::sort(m_order.begin(), m_order.end(), [this](unsigned a, unsigned b) { return m_tiles[a].cost > m_tiles[b].cost; });
+		unsigned workerCount = m_pool.getWorkerCount();
+		for (unsigned w = 0; w < workerCount; w++)
+		{
+			m_queues[w].head = 0;
+			m_queues[w].tiles.clear();
+			m_queues[w].predicted = 0.0;
+			m_queues[w].busyTime = 0.0;
+			m_queues[w].steals = 0;
+		}
+		for (unsigned t : m_order)
+		{
+			unsigned target = 0;
+			for (unsigned w = 1; w < workerCount; w++)
+				if (m_queues[w].predicted < m_queues[target].predicted)
+					target = w;
+			m_queues[target].tiles.push_back(t);
+			m_queues[target].predicted += m_tiles[t].cost;
+		}
+	}
+
+	bool Pop(WorkerQueue& queue, unsigned& tile)
+	{
+		// Owner and thieves both take from the front, so whatever is left over is always the most expensive tile
+		unsigned index = queue.head++;
+		if (index >= queue.tiles.size())
+			return false;
+		tile = queue.tiles[index];
+		return true;
+	}
+
+	bool Execute(const std::function<void(const RenderTile&, UINT32*)>& render, const std::function<bool()>& cancelled)
+	{
+		std::atomic<bool> stopped(false);
+		m_pool.Run([&](unsigned worker)
+		{
+			WorkerQueue& queue = m_queues[worker];
+			unsigned node = m_pool.getWorkerNode(worker);
+			UINT32* frame = m_nodeFrames[node].get<UINT32>();
+			LARGE_INTEGER begin, end;
+			QueryPerformanceCounter(&begin);
+			unsigned tile;
+			auto proceed = [&]
+			{
+				if (!stopped && cancelled())
+					stopped = true;
+				return !stopped;
+			};
+			while (proceed() && Pop(queue, tile))
+			{
+				m_tiles[tile].node = node;
+				render(m_tiles[tile], frame);
+			}
+			for (unsigned victim : queue.victims)
+				while (proceed() && Pop(m_queues[victim], tile))
+				{
+					queue.steals++;
+					m_tiles[tile].node = node;
+					render(m_tiles[tile], frame);
+				}
+			QueryPerformanceCounter(&end);
+			queue.busyTime = (double)(end.QuadPart - begin.QuadPart) / m_ticksPerMs;
+		});
+		return !stopped;
+	}
+
+	void Compose(BYTE* output, UINT rowPitch)
+	{
+		for (const RenderTile& tile : m_tiles)
+		{
+			const UINT32* frame = m_nodeFrames[tile.node].get<UINT32>();
+			for (int y = tile.top; y < tile.bottom; y++)
+				memcpy(output + y * rowPitch + tile.left * sizeof(UINT32), frame + y * SCREEN_WIDTH + tile.left, (tile.right - tile.left) * sizeof(UINT32));
+		}
+	}
+
+	void UpdateStats(double frameTime)
+	{
+		double total = 0.0, longest = 0.0;
+		m_stats.steals = 0;
+		for (unsigned w = 0; w < m_pool.getWorkerCount(); w++)
+		{
+			total += m_queues[w].busyTime;
+			longest = std::max(longest, m_queues[w].busyTime);
+			m_stats.steals += m_queues[w].steals;
+		}
+		m_stats.frameTime = frameTime;
+		m_stats.imbalance = total > 0.0 ? longest * m_pool.getWorkerCount() / total : 1.0;
+		m_stats.workers = m_pool.getWorkerCount();
+		m_stats.nodes = m_pool.getNodeCount();
+	}
+
+public:
+	TileScheduler(WorkerPool& pool) :m_pool(pool), m_queues(nullptr), m_queueCount(0), m_stats{}, m_ticksPerMs(1.0) {}
+	TileScheduler(const TileScheduler&) = delete;
+	TileScheduler& operator=(const TileScheduler&) = delete;
+	~TileScheduler()
+	{
+		for (unsigned w = 0; w < m_queueCount; w++)
+			m_queues[w].~WorkerQueue();
+		_aligned_free(m_queues);
+	}
+
+	template <typename Kernel, typename T>
+	bool Render(const Kernel& iterations, T iterCount, int step, const std::function<bool()>& cancelled, BYTE* output, UINT rowPitch)
+	{
+		// A step above one renders a preview with one sample per step x step block,
+		// which reuses the cost estimate of the previous frame instead of running its own pre-pass
+		if (m_tiles.empty() && !Init())
+			return false;
+		LARGE_INTEGER begin, end;
+		QueryPerformanceCounter(&begin);
+		if (step == 1)
+			EstimateCosts([&](int x, int y) { return (float)iterations(x, y); });
+		Schedule();
+		bool completed = Execute([&](const RenderTile& tile, UINT32* frame)
+		{
+			for (int y = tile.top; y < tile.bottom; y += step)
+				for (int x = tile.left; x < tile.right; x += step)
+				{
+					UINT32 color = IterationsToColor((float)(iterations(x, y) / iterCount));
+					for (int by = y; by < std::min(y + step, tile.bottom); by++)
+						for (int bx = x; bx < std::min(x + step, tile.right); bx++)
+							frame[by * SCREEN_WIDTH + bx] = color;
+				}
+		}, cancelled);
+		if (!completed)
+			return false;
+		Compose(output, rowPitch);
+		QueryPerformanceCounter(&end);
+		UpdateStats((double)(end.QuadPart - begin.QuadPart) / m_ticksPerMs);
+		return true;
+	}
+
+	const SchedulerStats& getStats() const
+	{
+		return m_stats;
+	}
+};
+
+WorkerPool g_workerPool;
+TileScheduler g_tileScheduler(g_workerPool);
+
+#pragma endregion
+
+#pragma region Reference orbits
+
+struct OrbitKey
+{
+	double reference[2];
+	double offset[2];
+	bool isMandelbrot;
+};
+
+class ReferenceOrbit
+{
+	OrbitKey m_key;
+	std::vector<double> m_points;
+	bool m_escaped;
+
+public:
+	ReferenceOrbit() :m_key{}, m_escaped(false) {}
+
+	void Reset(const OrbitKey& key)
+	{
+		m_key = key;
+		m_points.clear();
+		m_escaped = false;
+	}
+	bool Extend(double iterCount, const std::function<bool()>& cancelled)
+	{
+		// Keeps one point more than the iteration count, or stops after the first escaped point.
+		// A cancelled extension keeps what it has computed, the next call continues from there
+		iterCount = LengthLimit(iterCount);
+		if (m_points.empty())
+		{
+			m_points.push_back(m_key.isMandelbrot ? 0.0 : m_key.reference[0]);
+			m_points.push_back(m_key.isMandelbrot ? 0.0 : m_key.reference[1]);
+		}
+		double cx = m_key.isMandelbrot ? m_key.reference[0] : m_key.offset[0];
+		double cy = m_key.isMandelbrot ? m_key.reference[1] : m_key.offset[1];
+		double zx = m_points[m_points.size() - 2];
+		double zy = m_points[m_points.size() - 1];
+		unsigned chunk = 0;
+		for (double i = (double)(getLength() - 1); !m_escaped && i < iterCount; i++)
+		{
+			if (++chunk == ORBIT_CHUNK)
+			{
+				chunk = 0;
+				if (cancelled())
+					return false;
+			}
+			double tmp = zx * zx - zy * zy + cx;
+			zy = 2 * zx * zy + cy;
+			zx = tmp;
+			m_points.push_back(zx);
+			m_points.push_back(zy);
+			m_escaped = zx * zx + zy * zy > 4;
+		}
+		return true;
+	}
+	bool IsComplete(double iterCount) const
+	{
+		return !m_points.empty() && (m_escaped || (double)(getLength() - 1) >= LengthLimit(iterCount));
+	}
+	static double LengthLimit(double iterCount)
+	{
+		// Longer iteration counts keep rebasing onto the start of the orbit instead of growing it without bound
+		return std::min(iterCount, (double)(ORBIT_MAX_LENGTH - 1));
+	}
+
+	inline double Iterate(const FractalData<double>& data, int x, int y) const
+	{
+		// Perturbation around the reference: only the small difference to the reference orbit is iterated,
+		// and it is rebased to the start of the orbit when the reference runs out or the difference grows too big
+		const double* Z = m_points.data();
+		size_t last = getLength() - 1;
+		size_t n = 0;
+		double dx = (((x + 0.5) / SCREEN_WIDTH * 2 - 1) * data.aspectRatio[0]) / data.zoom + (data.center[0] - m_key.reference[0]);
+		double dy = ((1 - (y + 0.5) / SCREEN_HEIGHT * 2) * data.aspectRatio[1]) / data.zoom + (data.center[1] - m_key.reference[1]);
+		double dcx = 0.0, dcy = 0.0;
+		if (m_key.isMandelbrot)
+		{
+			dcx = dx;
+			dcy = dy;
+			dx = 0.0;
+			dy = 0.0;
+		}
+		double i, tmp, zx, zy, rx, ry;
+		for (i = 0.0; i < data.iterCount; i++)
+		{
+			zx = Z[2 * n];
+			zy = Z[2 * n + 1];
+			tmp = 2 * (zx * dx - zy * dy) + dx * dx - dy * dy + dcx;
+			dy = 2 * (zx * dy + zy * dx) + 2 * dx * dy + dcy;
+			dx = tmp;
+			n++;
+			zx = Z[2 * n] + dx;
+			zy = Z[2 * n + 1] + dy;
+			if (zx * zx + zy * zy > 4.0)
+				break;
+			rx = (Z[2 * n] - Z[0]) + dx;
+			ry = (Z[2 * n + 1] - Z[1]) + dy;
+			if (n == last || rx * rx + ry * ry < dx * dx + dy * dy)
+			{
+				dx = rx;
+				dy = ry;
+				n = 0;
+			}
+		}
+		return i;
+	}
+
+	const OrbitKey& getKey() const
+	{
+		return m_key;
+	}
+	size_t getLength() const
+	{
+		return m_points.size() / 2;
+	}
+};
+
+class OrbitCache
+{
+	// Orbits are computed in double, so extending one costs about as much per iteration as compressing
+	// or reading it back would. They are kept as they are, in memory, and only the work already done is reused
+	struct Entry
+	{
+		ReferenceOrbit orbit;
+		UINT64 lastUse;
+	};
+
+	std::vector<std::unique_ptr<Entry>> m_entries;
+	UINT64 m_useCounter;
+
+private:
+	static OrbitKey MakeKey(const FractalData<double>& data, bool isMandelbrot)
+	{
+		OrbitKey key{};
+		key.reference[0] = data.center[0];
+		key.reference[1] = data.center[1];
+		if (!isMandelbrot)
+		{
+			key.offset[0] = data.offset[0];
+			key.offset[1] = data.offset[1];
+		}
+		key.isMandelbrot = isMandelbrot;
+		return key;
+	}
+	static bool Covers(const OrbitKey& key, const FractalData<double>& data, bool isMandelbrot)
+	{
+		// An orbit is reused while its reference point stays within a few view radii of the view center,
+		// which keeps the perturbation deltas small relative to the pixel spacing
+		OrbitKey wanted = MakeKey(data, isMandelbrot);
+		if (key.isMandelbrot != wanted.isMandelbrot || key.offset[0] != wanted.offset[0] || key.offset[1] != wanted.offset[1])
+			return false;
+		double radius = ORBIT_VALIDITY * sqrt(data.aspectRatio[0] * data.aspectRatio[0] + data.aspectRatio[1] * data.aspectRatio[1]) / data.zoom;
+		return Distance(key, data) <= radius * radius;
+	}
+	static double Distance(const OrbitKey& key, const FractalData<double>& data)
+	{
+		double dx = data.center[0] - key.reference[0];
+		double dy = data.center[1] - key.reference[1];
+		return dx * dx + dy * dy;
+	}
+
+	void Trim(const Entry* keep)
+	{
+		// Least recently used orbits go first, the one about to be rendered from always stays
+		while (true)
+		{
+			SIZE_T memoryUsed = 0;
+			size_t oldest = m_entries.size();
+			for (size_t i = 0; i < m_entries.size(); i++)
+			{
+				memoryUsed += m_entries[i]->orbit.getLength() * 2 * sizeof(double);
+				if (m_entries[i].get() != keep && (oldest == m_entries.size() || m_entries[i]->lastUse < m_entries[oldest]->lastUse))
+					oldest = i;
+			}
+			if ((memoryUsed <= ORBIT_CACHE_MEMORY && m_entries.size() <= ORBIT_CACHE_ENTRIES) || oldest == m_entries.size())
+				return;
+			m_entries.erase(m_entries.begin() + oldest);
+		}
+	}
+
+public:
+	OrbitCache() :m_useCounter(0) {}
+
+	const ReferenceOrbit* Acquire(const FractalData<double>& data, bool isMandelbrot, const std::function<bool()>& cancelled)
+	{
+		Entry* nearest = nullptr;
+		for (std::unique_ptr<Entry>& entry : m_entries)
+			if (Covers(entry->orbit.getKey(), data, isMandelbrot) &&
+				(!nearest || Distance(entry->orbit.getKey(), data) < Distance(nearest->orbit.getKey(), data)))
+				nearest = entry.get();
+		if (!nearest)
+		{
+			m_entries.push_back(std::unique_ptr<Entry>(new Entry()));
+			nearest = m_entries.back().get();
+			nearest->orbit.Reset(MakeKey(data, isMandelbrot));
+		}
+		nearest->lastUse = ++m_useCounter;
+		bool complete = nearest->orbit.IsComplete(data.iterCount) || nearest->orbit.Extend(data.iterCount, cancelled);
+		Trim(nearest);
+		return complete ? &nearest->orbit : nullptr;
+	}
+};
+
+OrbitCache g_orbitCache;
+
+#pragma endregion
+
+#pragma region Orbit density
+
+enum DensityMode
+{
+	DENSITY_OFF,
+	DENSITY_BUDDHABROT,
+	DENSITY_NEBULABROT,
+	DENSITY_MODE_COUNT
+};
+
+struct DensityStats
+{
+	UINT64 samples;
+	UINT64 orbits;
+	double orbitsPerSecond;
+};
+
+inline bool InsideMainBulbs(double cx, double cy)
+{
+	double q = (cx - 0.25) * (cx - 0.25) + cy * cy;
+	if (q * (q + (cx - 0.25)) <= 0.25 * cy * cy)
+		return true;
+	return (cx + 1) * (cx + 1) + cy * cy <= 0.0625;
+}
+
+class OrbitDensityRenderer
+{
+	struct Worker
+	{
+		NodeLocalBuffer hits;
+		UINT64 random;
+		UINT64 samples;
+		UINT64 orbits;
+	};
+
+	WorkerPool& m_pool;
+	std::unique_ptr<Worker[]> m_workers;
+	std::vector<double> m_density;
+	std::vector<double> m_cdf;
+	std::vector<float> m_sampleWeights;
+	FractalData<double> m_view;
+	int m_mode;
+	int m_channels;
+	double m_limits[3];
+	double m_scale[2];
+	UINT64 m_passSamples;
+	double m_elapsed;
+	double m_lastDisplay;
+	DensityStats m_stats;
+	double m_ticksPerMs;
+	bool m_valid;
+
+private:
+	static double NextUniform(UINT64& state)
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return (double)((state * 2685821657736338717ull) >> 11) * (1.0 / 9007199254740992.0);
+	}
+	static double EscapeLength(double cx, double cy, double iterCount)
+	{
+		// Returns how many points the orbit visits before it escapes, or -1 when it stays bounded
+		double zx = 0.0, zy = 0.0, tmp;
+		for (double i = 0.0; i < iterCount; i++)
+		{
+			tmp = zx * zx - zy * zy + cx;
+			zy = 2 * zx * zy + cy;
+			zx = tmp;
+			if (zx * zx + zy * zy > 4.0)
+				return i;
+		}
+		return -1.0;
+	}
+	template <typename F>
+	static void Replay(double cx, double cy, double length, F visit)
+	{
+		// Iterating again is cheaper than storing the points, most orbits never escape and would be stored for nothing
+		double zx = 0.0, zy = 0.0, tmp;
+		for (double i = 0.0; i < length; i++)
+		{
+			tmp = zx * zx - zy * zy + cx;
+			zy = 2 * zx * zy + cy;
+			zx = tmp;
+			visit(zx, zy);
+		}
+	}
+	bool IsSameView(const FractalData<double>& view) const
+	{
+		// The offset only picks the Julia parameter, moving it does not change the density image
+		return view.center[0] == m_view.center[0] && view.center[1] == m_view.center[1] && view.zoom == m_view.zoom &&
+			view.aspectRatio[0] == m_view.aspectRatio[0] && view.aspectRatio[1] == m_view.aspectRatio[1] &&
+			view.iterCount == m_view.iterCount;
+	}
+	inline int PixelIndex(double x, double y) const
+	{
+		double px = (x - m_view.center[0]) * m_scale[0] + SCREEN_WIDTH / 2.0;
+		double py = (m_view.center[1] - y) * m_scale[1] + SCREEN_HEIGHT / 2.0;
+		if (px < 0.0 || px >= SCREEN_WIDTH || py < 0.0 || py >= SCREEN_HEIGHT)
+			return -1;
+		return (int)py * SCREEN_WIDTH + (int)px;
+	}
+
+	bool Init()
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		m_ticksPerMs = (double)frequency.QuadPart / 1000.0;
+		m_workers.reset(new Worker[m_pool.getWorkerCount()]);
+		for (unsigned w = 0; w < m_pool.getWorkerCount(); w++)
+		{
+			if (!m_workers[w].hits.Allocate(3 * SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(float), m_pool.getNodeNumber(m_pool.getWorkerNode(w))))
+			{
+				m_workers.reset();
+				return false;
+			}
+			m_workers[w].random = 0x9E3779B97F4A7C15ull * (w + 1);
+		}
+		return true;
+	}
+
+	bool Reset(const FractalData<double>& view, int mode, const std::function<bool()>& cancelled)
+	{
+		m_valid = false;
+		m_view = view;
+		m_mode = mode;
+		m_channels = mode == DENSITY_NEBULABROT ? 3 : 1;
+		m_limits[0] = view.iterCount;
+		m_limits[1] = view.iterCount / 10;
+		m_limits[2] = view.iterCount / 100;
+		m_scale[0] = view.zoom / view.aspectRatio[0] * SCREEN_WIDTH / 2;
+		m_scale[1] = view.zoom / view.aspectRatio[1] * SCREEN_HEIGHT / 2;
+		m_density.assign(m_channels * SCREEN_WIDTH * SCREEN_HEIGHT, 0.0);
+		m_pool.Run([this](unsigned w)
+		{
+			memset(m_workers[w].hits.get<float>(), 0, 3 * SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(float));
+			m_workers[w].samples = 0;
+			m_workers[w].orbits = 0;
+		});
+		if (!BuildImportanceMap(cancelled))
+			return false;
+		m_elapsed = 0.0;
+		m_lastDisplay = -DENSITY_DISPLAY_INTERVAL;
+		m_valid = true;
+		return true;
+	}
+
+	bool BuildImportanceMap(const std::function<bool()>& cancelled)
+	{
+		// Mandelbrot pre-pass: every cell of the sampling square is weighted by how many points of a few probe orbits
+		// land in the view. A uniform share keeps every cell possible, and each sample carries the inverse of its
+		// probability relative to uniform sampling, so the density stays unbiased
+		const double cellSize = 2 * DENSITY_SAMPLE_RADIUS / DENSITY_GRID;
+		std::vector<double> weights(DENSITY_GRID * DENSITY_GRID);
+		std::atomic<unsigned> next(0);
+		std::atomic<bool> stopped(false);
+		m_pool.Run([&](unsigned w)
+		{
+			for (unsigned cell; !stopped && (cell = next++) < weights.size();)
+			{
+				if (cell % DENSITY_GRID == 0 && cancelled())
+				{
+					stopped = true;
+					return;
+				}
+				double hits = 0.0;
+				for (int probe = 0; probe < 4; probe++)
+				{
+					double cx = -DENSITY_SAMPLE_RADIUS + (cell % DENSITY_GRID + 0.25 + 0.5 * (probe & 1)) * cellSize;
+					double cy = -DENSITY_SAMPLE_RADIUS + (cell / DENSITY_GRID + 0.25 + 0.5 * (probe >> 1)) * cellSize;
+					if (InsideMainBulbs(cx, cy))
+						continue;
+					double length = EscapeLength(cx, cy, m_limits[0]);
+					Replay(cx, cy, length, [&](double x, double y)
+					{
+						if (PixelIndex(x, y) >= 0)
+							hits++;
+					});
+				}
+				weights[cell] = hits;
+			}
+		});
+		if (stopped)
+			return false;
+		double total = 0.0;
+		for (double weight : weights)
+			total += weight;
+		double uniform = std::max(total, 1.0) * DENSITY_UNIFORM_SHARE / weights.size();
+		m_cdf.resize(weights.size());
+		m_sampleWeights.resize(weights.size());
+		total = 0.0;
+		for (size_t cell = 0; cell < weights.size(); cell++)
+		{
+			weights[cell] += uniform;
+			total += weights[cell];
+			m_cdf[cell] = total;
+		}
+		for (size_t cell = 0; cell < weights.size(); cell++)
+			m_sampleWeights[cell] = (float)(total / (weights.size() * weights[cell]));
+		return true;
+	}
+
+	void Sample(Worker& worker, std::atomic<UINT64>& next, UINT64 chunkCount, const std::function<bool()>& cancelled, std::atomic<bool>& stopped)
+	{
+		// Chunks are handed out one at a time, so a worker slowed down by long orbits just takes fewer of them
+		const double cellSize = 2 * DENSITY_SAMPLE_RADIUS / DENSITY_GRID;
+		const size_t pixelCount = SCREEN_WIDTH * SCREEN_HEIGHT;
+		float* hits = worker.hits.get<float>();
+		for (UINT64 chunk; !stopped && (chunk = next++) < chunkCount;)
+		{
+			if (cancelled())
+			{
+				stopped = true;
+				return;
+			}
+			for (unsigned s = 0; s < DENSITY_CHUNK; s++)
+			{
+				size_t cell = std::upper_bound(m_cdf.begin(), m_cdf.end(), NextUniform(worker.random) * m_cdf.back()) - m_cdf.begin();
+				cell = std::min(cell, m_cdf.size() - 1);
+				double cx = -DENSITY_SAMPLE_RADIUS + (cell % DENSITY_GRID + NextUniform(worker.random)) * cellSize;
+				double cy = -DENSITY_SAMPLE_RADIUS + (cell / DENSITY_GRID + NextUniform(worker.random)) * cellSize;
+				worker.samples++;
+				if (InsideMainBulbs(cx, cy))
+					continue;
+				double length = EscapeLength(cx, cy, m_limits[0]);
+				if (length < 0.0)
+					continue;
+				worker.orbits++;
+				float weight = m_sampleWeights[cell];
+				Replay(cx, cy, length, [&](double x, double y)
+				{
+					int pixel = PixelIndex(x, y);
+					if (pixel < 0)
+						return;
+					for (int k = 0; k < m_channels && length < m_limits[k]; k++)
+						hits[k * pixelCount + pixel] += weight;
+				});
+			}
+		}
+	}
+
+	void Merge()
+	{
+		// Every worker owns a private hit buffer, they are only summed here, one row at a time per worker.
+		// This touches every buffer in full, so it only runs when a frame is about to be shown
+		const size_t pixelCount = SCREEN_WIDTH * SCREEN_HEIGHT;
+		std::atomic<unsigned> next(0);
+		m_pool.Run([&](unsigned)
+		{
+			for (unsigned row; (row = next++) < (unsigned)(m_channels * SCREEN_HEIGHT);)
+			{
+				size_t offset = (row / SCREEN_HEIGHT) * pixelCount + (row % SCREEN_HEIGHT) * SCREEN_WIDTH;
+				double* density = m_density.data() + offset;
+				for (unsigned w = 0; w < m_pool.getWorkerCount(); w++)
+				{
+					float* hits = m_workers[w].hits.get<float>() + offset;
+					for (int x = 0; x < SCREEN_WIDTH; x++)
+						density[x] += hits[x];
+					memset(hits, 0, SCREEN_WIDTH * sizeof(float));
+				}
+			}
+		});
+	}
+
+	void Resolve(BYTE* output, UINT rowPitch)
+	{
+		// Brightness is relative to a high percentile of the lit pixels, so it stays stable while samples accumulate
+		const size_t pixelCount = SCREEN_WIDTH * SCREEN_HEIGHT;
+		double scale[3];
+		for (int k = 0; k < m_channels; k++)
+		{
+			std::vector<double> lit;
+			for (size_t p = k * pixelCount; p < (k + 1) * pixelCount; p += 7)
+				if (m_density[p] > 0.0)
+					lit.push_back(m_density[p]);
+			scale[k] = 0.0;
+			if (!lit.empty())
+			{
+				std::nth_element(lit.begin(), lit.begin() + lit.size() * 995 / 1000, lit.end());
+				scale[k] = 1.0 / lit[lit.size() * 995 / 1000];
+			}
+		}
+		auto tone = [](double value) { return (UINT32)(sqrt(std::min(value, 1.0)) * 255.0 + 0.5); };
+		std::atomic<unsigned> next(0);
+		m_pool.Run([&](unsigned)
+		{
+			for (unsigned y; (y = next++) < (unsigned)SCREEN_HEIGHT;)
+			{
+				UINT32* line = (UINT32*)(output + y * rowPitch);
+				for (int x = 0; x < SCREEN_WIDTH; x++)
+				{
+					size_t p = y * SCREEN_WIDTH + x;
+					UINT32 r = tone(m_density[p] * scale[0]);
+					UINT32 g = m_channels == 3 ? tone(m_density[pixelCount + p] * scale[1]) : r;
+					UINT32 b = m_channels == 3 ? tone(m_density[2 * pixelCount + p] * scale[2]) : r;
+					line[x] = r | g << 8 | b << 16 | 0xFFu << 24;
+				}
+			}
+		});
+	}
+
+public:
+	OrbitDensityRenderer(WorkerPool& pool) :m_pool(pool), m_mode(DENSITY_OFF), m_channels(1), m_limits{}, m_scale{},
+		m_passSamples(DENSITY_CHUNK), m_elapsed(0.0), m_lastDisplay(0.0), m_stats{}, m_ticksPerMs(1.0), m_valid(false) {}
+
+	bool Accumulate(const FractalData<double>& view, int mode, const std::function<bool()>& cancelled)
+	{
+		// One progressive pass: sample for about a frame budget into the per-worker hit buffers
+		if (!m_workers && !Init())
+			return false;
+		LARGE_INTEGER begin, end;
+		QueryPerformanceCounter(&begin);
+		if ((!m_valid || mode != m_mode || !IsSameView(view)) && !Reset(view, mode, cancelled))
+			return false;
+		if (IsFinished())
+			return true;
+		std::atomic<bool> stopped(false);
+		std::atomic<UINT64> next(0);
+		UINT64 chunkCount = (m_passSamples + DENSITY_CHUNK - 1) / DENSITY_CHUNK;
+		m_pool.Run([&](unsigned w) { Sample(m_workers[w], next, chunkCount, cancelled, stopped); });
+		QueryPerformanceCounter(&end);
+		double passTime = (double)(end.QuadPart - begin.QuadPart) / m_ticksPerMs;
+		m_elapsed += passTime;
+		if (stopped)
+			return false;
+		double adjust = std::min(std::max(FRAME_BUDGET / std::max(passTime, 0.1), 0.5), 2.0);
+		m_passSamples = std::max((UINT64)(m_passSamples * adjust), (UINT64)DENSITY_CHUNK);
+		return true;
+	}
+	bool IsDisplayDue() const
+	{
+		return m_elapsed - m_lastDisplay >= DENSITY_DISPLAY_INTERVAL;
+	}
+	bool IsFinished() const
+	{
+		// Past the time limit the noise hardly changes between displays, so an idle window stops sampling
+		return m_elapsed >= DENSITY_TIME_LIMIT;
+	}
+	void Display(BYTE* output, UINT rowPitch)
+	{
+		// Merges the hits gathered since the last display and shows the total so far.
+		// The throughput covers all the time spent since the view was set, merging and the importance map included
+		LARGE_INTEGER begin, end;
+		QueryPerformanceCounter(&begin);
+		Merge();
+		Resolve(output, rowPitch);
+		QueryPerformanceCounter(&end);
+		m_elapsed += (double)(end.QuadPart - begin.QuadPart) / m_ticksPerMs;
+		m_lastDisplay = m_elapsed;
+		m_stats.samples = 0;
+		m_stats.orbits = 0;
+		for (unsigned w = 0; w < m_pool.getWorkerCount(); w++)
+		{
+			m_stats.samples += m_workers[w].samples;
+			m_stats.orbits += m_workers[w].orbits;
+		}
+		m_stats.orbitsPerSecond = m_elapsed > 0.0 ? m_stats.orbits / m_elapsed * 1000.0 : 0.0;
+	}
+
+	const DensityStats& getStats() const
+	{
+		return m_stats;
+	}
+};
+
+OrbitDensityRenderer g_densityRenderer(g_workerPool);
+
+#pragma endregion
+
+#pragma region Render thread
+
+enum FrameResult
+{
+	FRAME_CANCELLED,
+	FRAME_COMPLETED,
+	FRAME_PROGRESSIVE
+};
+
+struct ViewState
+{
+	FractalData<float> dataFloat;
+	FractalData<double> dataDouble;
+	bool highPrecision;
+	bool cpuRendering;
+	int densityMode;
+};
+
+class RenderThread
+{
+	typedef std::function<FrameResult(const ViewState&, int, const std::function<bool()>&)> RenderFunction;
+
+	struct Target
+	{
+		RenderFunction render;
+		ViewState pending;
+		bool hasPending;
+		std::atomic<UINT64> generation;
+		double frameTime;
+		bool starved;
+		bool progressive;
+	};
+
+	std::vector<std::unique_ptr<Target>> m_targets;
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	bool m_quit;
+	double m_ticksPerMs;
+
+private:
+	bool HasPending() const
+	{
+		for (const std::unique_ptr<Target>& target : m_targets)
+			if (target->hasPending)
+				return true;
+		return false;
+	}
+	void Loop()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			m_wake.wait(lock, [this] { return m_quit || HasPending(); });
+			if (m_quit)
+				return;
+			for (std::unique_ptr<Target>& target : m_targets)
+			{
+				if (!target->hasPending)
+					continue;
+				ViewState view = target->pending;
+				target->hasPending = false;
+				UINT64 generation = target->generation;
+				lock.unlock();
+				Draw(*target, view, generation);
+				lock.lock();
+			}
+		}
+	}
+	void Draw(Target& target, const ViewState& view, UINT64 generation)
+	{
+		// Any newer snapshot cancels the frame in flight. When the last full frame ran over budget,
+		// a coarser preview sized to fit the budget goes out first, and the full resolution frame follows
+		// if nothing newer arrived in the meantime. Progressive targets size their passes to the budget themselves
+		// and get no preview. Only when a snapshot was dropped without showing anything does the first frame
+		// of the next one run uncancelled, so a continuous drag still updates the window
+		std::function<bool()> cancelled = [&target, generation] { return target.generation != generation; };
+		std::function<bool()> uncancelled = [] { return false; };
+		int step = 1;
+		while (!target.progressive && step < MAX_PREVIEW_STEP && target.frameTime > FRAME_BUDGET * step * step)
+			step *= 2;
+		LARGE_INTEGER begin, end;
+		bool previewShown = false;
+		if (step > 1)
+		{
+			QueryPerformanceCounter(&begin);
+			FrameResult preview = target.render(view, step, target.starved ? uncancelled : cancelled);
+			QueryPerformanceCounter(&end);
+			if (preview == FRAME_CANCELLED)
+			{
+				target.starved = true;
+				return;
+			}
+			if (preview == FRAME_COMPLETED)
+			{
+				target.frameTime = (double)(end.QuadPart - begin.QuadPart) / m_ticksPerMs * step * step;
+				target.starved = false;
+				previewShown = true;
+			}
+		}
+		if (!target.starved && cancelled())
+			return;
+		QueryPerformanceCounter(&begin);
+		FrameResult result = target.render(view, 1, target.starved ? uncancelled : cancelled);
+		QueryPerformanceCounter(&end);
+		double frameTime = (double)(end.QuadPart - begin.QuadPart) / m_ticksPerMs;
+		target.frameTime = result != FRAME_CANCELLED ? frameTime : std::max(target.frameTime, frameTime);
+		target.starved = result == FRAME_CANCELLED && !previewShown;
+		if (result != FRAME_CANCELLED)
+			target.progressive = result == FRAME_PROGRESSIVE;
+		if (result == FRAME_PROGRESSIVE)
+		{
+			// Render the same view again unless a newer one arrived meanwhile
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!target.hasPending && target.generation == generation)
+			{
+				target.pending = view;
+				target.hasPending = true;
+			}
+		}
+	}
+
+public:
+	RenderThread() :m_quit(false), m_ticksPerMs(1.0) {}
+	~RenderThread() { Stop(); }
+
+	unsigned AddTarget(const RenderFunction& render)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_targets.push_back(std::unique_ptr<Target>(new Target()));
+		m_targets.back()->render = render;
+		m_targets.back()->hasPending = false;
+		m_targets.back()->generation = 0;
+		m_targets.back()->frameTime = 0.0;
+		m_targets.back()->starved = false;
+		m_targets.back()->progressive = false;
+		return (unsigned)m_targets.size() - 1;
+	}
+	void Start()
+	{
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+		m_ticksPerMs = (double)frequency.QuadPart / 1000.0;
+		m_thread = std::thread(&RenderThread::Loop, this);
+	}
+	void Stop()
+	{
+		if (!m_thread.joinable())
+			return;
 		{
-			m_ptr->Release();
-			m_ptr = nullptr;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+			for (std::unique_ptr<Target>& target : m_targets)
+				target->generation++;
 		}
+		m_wake.notify_one();
+		m_thread.join();
+		m_quit = false;
 	}
-	T* get() const { return m_ptr; }
-	T* getAddress() const { return &m_ptr; }
-	operator T*() const { return m_ptr; }
-	operator bool() const { return m_ptr != nullptr; }
-	T* operator->() const { return m_ptr; }
-	T** operator&() { return &m_ptr; }
-	T* operator=(T* ptr) { return m_ptr = ptr; }
-	T* operator=(AutoReleasePtr& ptr)
+	void Submit(unsigned target, const ViewState& view)
 	{
-		m_ptr = ptr.m_ptr;
-		ptr.m_ptr = nullptr;
-		return m_ptr;
+		// Latest wins: an unrendered snapshot is simply overwritten
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_targets[target]->pending = view;
+			m_targets[target]->hasPending = true;
+			m_targets[target]->generation++;
+		}
+		m_wake.notify_one();
 	}
-	bool operator==(T* ptr) const { return m_ptr == ptr; }
-	bool operator!=(T* ptr) const { return m_ptr != ptr; }
 };
 
-struct Graphics
-{
-	AutoReleasePtr<ID3D11Device> device;
-	AutoReleasePtr<ID3D11DeviceContext> deviceContext;
-	AutoReleasePtr<IDXGISwapChain> swapChain;
-	AutoReleasePtr<ID3D11RenderTargetView> renderTargetView;
-	AutoReleasePtr<ID3D11Texture2D> depthStencilBuffer;
-	AutoReleasePtr<ID3D11DepthStencilView> depthStencilView;
-	AutoReleasePtr<ID3D11DepthStencilState> depthStencilState;
-	AutoReleasePtr<ID3D11RasterizerState> rasterizerState;
+RenderThread g_renderThread;
 
-	AutoReleasePtr<ID3D11VertexShader> vertexShader;
-	AutoReleasePtr<ID3D11PixelShader> psFloat;
-	AutoReleasePtr<ID3D11PixelShader> psDouble;
-	AutoReleasePtr<ID3D11Buffer> vertexBuffer;
-	AutoReleasePtr<ID3D11InputLayout> inputLayout;
-	AutoReleasePtr<ID3D11Buffer> cbFloat;
-	AutoReleasePtr<ID3D11Buffer> cbDouble;
+#pragma endregion
+
+#pragma region View input
+
+enum ViewIndex
+{
+	VIEW_JULIA,
+	VIEW_MANDELBROT,
+	VIEW_COUNT
 };
 
-template <typename T>
-struct FractalData
+class ViewController
 {
-	T center[2];
-	T aspectRatio[2];
-	T offset[2];
-	T zoom;
-	T iterCount;
+	// Turns input messages into view changes without touching any window, so the same path runs headless.
+	// Every handler returns the views to redraw as a mask of ViewIndex bits
+	ViewState* m_views[VIEW_COUNT];
+	short m_prevMX;
+	short m_prevMY;
 
-public:
-	inline FractalData()
+private:
+	unsigned SetOffset(unsigned view, short mx, short my)
 	{
-		SetToDefault();
+		ViewState& source = *m_views[view];
+		ViewState& other = *m_views[view == VIEW_MANDELBROT ? VIEW_JULIA : VIEW_MANDELBROT];
+		source.dataFloat.setOffset(mx, my);
+		source.dataDouble.setOffset(mx, my);
+		other.dataFloat.offset[0] = source.dataFloat.offset[0];
+		other.dataFloat.offset[1] = source.dataFloat.offset[1];
+		other.dataDouble.offset[0] = source.dataDouble.offset[0];
+		other.dataDouble.offset[1] = source.dataDouble.offset[1];
+		return 1 << VIEW_JULIA;
 	}
-	inline void SetToDefault()
+	unsigned MouseMove(unsigned view, WPARAM wparam, LPARAM lparam)
 	{
-		center[0] = 0;
-		center[1] = 0;
-		aspectRatio[0] = (T)SCREEN_WIDTH / (T)SCREEN_HEIGHT;
-		aspectRatio[1] = 1;
-		offset[0] = 0;
-		offset[1] = 0;
-		zoom = 1;
-		iterCount = 256;
+		short mx = LOWORD(lparam);
+		short my = HIWORD(lparam);
+		unsigned redraw = 0;
+		if (wparam&MK_LBUTTON)
+		{
+			if (wparam&MK_CONTROL)
+				redraw = SetOffset(view, mx, my);
+			else
+			{
+				m_views[view]->dataFloat.Move(mx - m_prevMX, my - m_prevMY);
+				m_views[view]->dataDouble.Move(mx - m_prevMX, my - m_prevMY);
+				redraw = 1 << view;
+			}
+		}
+		m_prevMX = mx;
+		m_prevMY = my;
+		return redraw;
 	}
-	inline void Zoom(T z)
+	unsigned MouseWheel(unsigned view, WPARAM wparam)
 	{
-		zoom *= z;
+		double change = (wparam & MK_SHIFT) ? 2.0 : 1.1;
+		if (GET_WHEEL_DELTA_WPARAM(wparam) < 0)
+			change = 1 / change;
+		if (wparam & MK_CONTROL)
+		{
+			m_views[view]->dataFloat.MulIterCount((float)change);
+			m_views[view]->dataDouble.MulIterCount((double)change);
+		}
+		else
+		{
+			m_views[view]->dataFloat.Zoom((float)change);
+			m_views[view]->dataDouble.Zoom((double)change);
+		}
+		return 1 << view;
 	}
-	inline void MulIterCount(T i)
+	unsigned RButtonDown(unsigned view, WPARAM wparam, LPARAM lparam)
 	{
-		iterCount *= i;
+		short mx = LOWORD(lparam);
+		short my = HIWORD(lparam);
+		if (wparam&MK_CONTROL)
+			return SetOffset(view, mx, my);
+		m_views[view]->dataFloat.setCenter(mx, my);
+		m_views[view]->dataDouble.setCenter(mx, my);
+		return 1 << view;
 	}
-	inline void Move(short dx, short dy)
+	unsigned KeyDown(WPARAM key)
 	{
-		center[0] -= dx / zoom * aspectRatio[0] / SCREEN_WIDTH * 2;
-		center[1] += dy / zoom * aspectRatio[1] / SCREEN_HEIGHT * 2;
+		switch (key)
+		{
+		case VK_SPACE:
+			for (ViewState* view : m_views)
+				view->highPrecision = !view->highPrecision;
+			return (1 << VIEW_COUNT) - 1;
+		case 'R':
+			return Reset();
+		case 'C':
+			for (ViewState* view : m_views)
+				view->cpuRendering = !view->cpuRendering;
+			return (1 << VIEW_COUNT) - 1;
+		case 'B':
+			m_views[VIEW_MANDELBROT]->densityMode = (m_views[VIEW_MANDELBROT]->densityMode + 1) % DENSITY_MODE_COUNT;
+			return 1 << VIEW_MANDELBROT;
+		}
+		return 0;
 	}
-	inline void setCenter(short x, short y)
+
+public:
+	ViewController(ViewState& julia, ViewState& mandelbrot) :m_views{ &julia, &mandelbrot }, m_prevMX(0), m_prevMY(0) {}
+
+	unsigned HandleInput(unsigned view, UINT msg, WPARAM wparam, LPARAM lparam)
 	{
-		center[0] = (x / (T)SCREEN_WIDTH * 2 - 1) / zoom * aspectRatio[0] + center[0];
-		center[1] = (-y / (T)SCREEN_HEIGHT * 2 + 1) / zoom * aspectRatio[1] + center[1];
+		switch (msg)
+		{
+		case WM_MOUSEMOVE:
+			return MouseMove(view, wparam, lparam);
+		case WM_MOUSEWHEEL:
+			return MouseWheel(view, wparam);
+		case WM_RBUTTONDOWN:
+			return RButtonDown(view, wparam, lparam);
+		case WM_KEYDOWN:
+			return KeyDown(wparam);
+		}
+		return 0;
 	}
-	inline void setOffset(short x, short y)
+	unsigned Reset()
 	{
-		offset[0] = (x / (T)SCREEN_WIDTH * 2 - 1) / zoom * aspectRatio[0] + center[0];
-		offset[1] = (-y / (T)SCREEN_HEIGHT * 2 + 1) / zoom * aspectRatio[1] + center[1];
+		for (ViewState* view : m_views)
+		{
+			view->highPrecision = false;
+			view->dataFloat.SetToDefault();
+			view->dataDouble.SetToDefault();
+		}
+		m_views[VIEW_MANDELBROT]->dataFloat.center[0] = -0.5f;
+		m_views[VIEW_MANDELBROT]->dataDouble.center[0] = -0.5;
+		return (1 << VIEW_COUNT) - 1;
 	}
 };
 
+#pragma endregion
+
+#pragma region Self test
+
+bool SameView(const ViewState& a, const ViewState& b)
+{
+	return a.dataFloat.center[0] == b.dataFloat.center[0] && a.dataFloat.center[1] == b.dataFloat.center[1] &&
+		a.dataDouble.center[0] == b.dataDouble.center[0] && a.dataDouble.center[1] == b.dataDouble.center[1];
+}
+
+INT RunSelfTest()
+{
+	// Feeds a burst of synthetic drag messages through the input reduction and the render thread into a stub renderer.
+	// The first frame is held until every snapshot has been submitted, so the outcome does not depend on timing:
+	// that frame has to be cancelled, the later snapshots coalesce into the last one, and that is the only other
+	// full resolution frame, rendered to completion. A preview may come before it, as the held frame ran over budget
+	ViewState julia{}, mandelbrot{};
+	ViewController controller(julia, mandelbrot);
+	controller.Reset();
+	RenderThread renderThread;
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool held = false, released = false;
+	ViewState rendered{};
+	unsigned started = 0, previews = 0, cancelledFrames = 0, completedFrames = 0;
+	unsigned target = renderThread.AddTarget([&](const ViewState& view, int step, const std::function<bool()>& cancelled)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (step > 1)
+		{
+			previews++;
+			return FRAME_COMPLETED;
+		}
+		started++;
+		if (!held)
+		{
+			held = true;
+			changed.notify_all();
+			changed.wait(lock, [&] { return released; });
+		}
+		if (cancelled())
+		{
+			cancelledFrames++;
+			return FRAME_CANCELLED;
+		}
+		completedFrames++;
+		rendered = view;
+		changed.notify_all();
+		return FRAME_COMPLETED;
+	});
+	renderThread.Start();
+
+	// The timeouts only keep a broken render thread from hanging the test, a passing run never reaches them
+	const unsigned moveCount = 200;
+	unsigned submitted = 0;
+	bool firstHeld = false, finished = false;
+	controller.HandleInput(VIEW_MANDELBROT, WM_MOUSEMOVE, 0, MAKELPARAM(0, 0));
+	for (unsigned i = 1; i <= moveCount; i++)
+	{
+		if (controller.HandleInput(VIEW_MANDELBROT, WM_MOUSEMOVE, MK_LBUTTON, MAKELPARAM(i, i / 2)) & (1 << VIEW_MANDELBROT))
+		{
+			renderThread.Submit(target, mandelbrot);
+			submitted++;
+		}
+		if (i == 1)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			firstHeld = changed.wait_for(lock, std::chrono::seconds(10), [&] { return held; });
+		}
+	}
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		released = true;
+		changed.notify_all();
+		finished = changed.wait_for(lock, std::chrono::seconds(10), [&] { return completedFrames > 0; });
+	}
+	renderThread.Stop();
+
+	bool moved = mandelbrot.dataDouble.center[0] != -0.5;
+	bool finalRendered = SameView(rendered, mandelbrot);
+	bool passed = moved && firstHeld && finished && submitted == moveCount && started == 2 && cancelledFrames == 1 &&
+		completedFrames == 1 && previews <= 1 && finalRendered;
+	char report[256];
+	sprintf_s(report, "Render thread self test %s: %u snapshots, %u frames started, %u cancelled, %u completed, %u previews, final snapshot %s\n",
+		passed ? "passed" : "FAILED", submitted, started, cancelledFrames, completedFrames, previews, finalRendered ? "rendered" : "missing");
+
+	// The executable has no console of its own, the report goes to the one it was started from
+	FILE* console;
+	if (AttachConsole(ATTACH_PARENT_PROCESS) && freopen_s(&console, "CONOUT$", "w", stdout) == 0)
+	{
+		fputs(report, stdout);
+		fflush(stdout);
+	}
+	OutputDebugStringA(report);
+	return passed ? 0 : 1;
+}
+
+#pragma endregion
+
 class FractalWindow
 {
 	Graphics m_gfx;
 	HWND m_hwnd;
-	bool m_highPrecision;
-	FractalData<float> m_dataFloat;
-	FractalData<double> m_dataDouble;
+	LPCWSTR m_name;
+	bool m_isMandelbrot;
+	ViewState m_view;
+	unsigned m_renderTarget;
+	std::mutex m_titleMutex;
+	std::wstring m_title;
+
+public:
+	FractalWindow() :m_hwnd(NULL), m_renderTarget(NO_RENDER_TARGET) {}
 
 private:
 
@@ -309,21 +1781,45 @@ private:
 			return false;
 		if (FAILED(m_gfx.device->CreatePixelShader(shaderByteCode->GetBufferPointer(), shaderByteCode->GetBufferSize(), NULL, &m_gfx.psFloat)))
 			return false;
+		D3D11_FEATURE_DATA_DOUBLES doubles{};
+		m_gfx.device->CheckFeatureSupport(D3D11_FEATURE_DOUBLES, &doubles, sizeof(doubles));
+		if (doubles.DoublePrecisionFloatShaderOps)
+		{
+			shaderByteCode.Release();
+			if (FAILED(D3DCompile(psCodeDouble, strlen(psCodeDouble), NULL, NULL, NULL, "main", "ps_5_0", 0, 0, &shaderByteCode, NULL)))
+				return false;
+			if (FAILED(m_gfx.device->CreatePixelShader(shaderByteCode->GetBufferPointer(), shaderByteCode->GetBufferSize(), NULL, &m_gfx.psDouble)))
+				return false;
+		}
 		shaderByteCode.Release();
-		if (FAILED(D3DCompile(psCodeDouble, strlen(psCodeDouble), NULL, NULL, NULL, "main", "ps_5_0", 0, 0, &shaderByteCode, NULL)))
+		if (FAILED(D3DCompile(g_psCodeTexture, strlen(g_psCodeTexture), NULL, NULL, NULL, "main", "ps_5_0", 0, 0, &shaderByteCode, NULL)))
 			return false;
-		if (FAILED(m_gfx.device->CreatePixelShader(shaderByteCode->GetBufferPointer(), shaderByteCode->GetBufferSize(), NULL, &m_gfx.psDouble)))
+		if (FAILED(m_gfx.device->CreatePixelShader(shaderByteCode->GetBufferPointer(), shaderByteCode->GetBufferSize(), NULL, &m_gfx.psTexture)))
 			return false;
 		ZeroMemory(&bufferDesc, sizeof(bufferDesc));
 		bufferDesc.Usage = D3D11_USAGE_DYNAMIC;
-		bufferDesc.ByteWidth = sizeof(m_dataFloat);
+		bufferDesc.ByteWidth = sizeof(m_view.dataFloat);
 		bufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
 		bufferDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
 		if (FAILED(m_gfx.device->CreateBuffer(&bufferDesc, NULL, &m_gfx.cbFloat)))
 			return false;
-		bufferDesc.ByteWidth = sizeof(m_dataDouble);
+		bufferDesc.ByteWidth = sizeof(m_view.dataDouble);
 		if (FAILED(m_gfx.device->CreateBuffer(&bufferDesc, NULL, &m_gfx.cbDouble)))
 			return false;
+		D3D11_TEXTURE2D_DESC textureDesc{};
+		textureDesc.Width = SCREEN_WIDTH;
+		textureDesc.Height = SCREEN_HEIGHT;
+		textureDesc.MipLevels = 1;
+		textureDesc.ArraySize = 1;
+		textureDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+		textureDesc.SampleDesc.Count = 1;
+		textureDesc.Usage = D3D11_USAGE_DYNAMIC;
+		textureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+		textureDesc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+		if (FAILED(m_gfx.device->CreateTexture2D(&textureDesc, NULL, &m_gfx.frameTexture)))
+			return false;
+		if (FAILED(m_gfx.device->CreateShaderResourceView(m_gfx.frameTexture, NULL, &m_gfx.frameView)))
+			return false;
 
 		UINT stride = sizeof(float) * 5;
 		UINT offset = 0;
@@ -441,237 +1937,209 @@ public:
 		AdjustWindowRectEx(&rect, WS_OVERLAPPEDWINDOW, FALSE, WS_EX_OVERLAPPEDWINDOW);
 		rect.left = (GetSystemMetrics(SM_CXSCREEN) - rect.right) / 2;
 		rect.top = (GetSystemMetrics(SM_CYSCREEN) - rect.bottom) / 2;
-		m_hwnd = CreateWindowEx(WS_EX_OVERLAPPEDWINDOW, L"Fractal", isMandelbrot ? L"Mandelbrot" : L"Julia", WS_OVERLAPPEDWINDOW,
+		m_name = isMandelbrot ? L"Mandelbrot" : L"Julia";
+		m_hwnd = CreateWindowEx(WS_EX_OVERLAPPEDWINDOW, L"Fractal", m_name, WS_OVERLAPPEDWINDOW,
 			(GetSystemMetrics(SM_CXSCREEN) / 2 - rect.right) / 2 + (isMandelbrot ? (GetSystemMetrics(SM_CXSCREEN) / 2) : 0),
 			(GetSystemMetrics(SM_CYSCREEN) - rect.bottom) / 2,
 			rect.right, rect.bottom, NULL, NULL, GetModuleHandle(NULL), NULL);
-		m_highPrecision = false;
+		m_isMandelbrot = isMandelbrot;
+		m_view.highPrecision = false;
+		m_view.cpuRendering = false;
+		m_view.densityMode = DENSITY_OFF;
 		if (!InitDirect3D())
 			return false;
 		if (isMandelbrot)
 		{
 			if (!LoadResources(g_psCodeFloatMandelbrot, g_psCodeDoubleMandelbrot))
 				return false;
-			m_dataFloat.center[0] = -0.5f;
-			m_dataDouble.center[0] = -0.5;
+			m_view.dataFloat.center[0] = -0.5f;
+			m_view.dataDouble.center[0] = -0.5;
 		}
 		else
 		{
 			if (!LoadResources(g_psCodeFloatJulia, g_psCodeDoubleJulia))
 				return false;
 		}
+		m_renderTarget = g_renderThread.AddTarget([this](const ViewState& view, int step, const std::function<bool()>& cancelled)
+		{
+			return Render(view, step, cancelled);
+		});
 		ShowWindow(m_hwnd, SW_SHOW);
 		UpdateWindow(m_hwnd);
 		return true;
 	}
 
-	void SwitchPrecision()
+	void ChangePrecision(bool changeToHigh)
 	{
-		ChangePrecision(!m_highPrecision);
+		m_view.highPrecision = changeToHigh;
 	}
-	void ChangePrecision(bool changeToHigh)
+	bool UsesCpuRendering(const ViewState& view) const
+	{
+		return view.cpuRendering || view.densityMode != DENSITY_OFF || (view.highPrecision && m_gfx.psDouble == nullptr);
+	}
+	void BindPixelShader(const ViewState& view)
 	{
-		if (changeToHigh)
+		if (UsesCpuRendering(view))
+		{
+			m_gfx.deviceContext->PSSetShader(m_gfx.psTexture, NULL, 0);
+			m_gfx.deviceContext->PSSetShaderResources(0, 1, &m_gfx.frameView);
+		}
+		else if (view.highPrecision)
 		{
-			m_highPrecision = true;
 			m_gfx.deviceContext->PSSetShader(m_gfx.psDouble, NULL, 0);
 			m_gfx.deviceContext->PSSetConstantBuffers(0, 1, &m_gfx.cbDouble);
 		}
 		else
 		{
-			m_highPrecision = false;
 			m_gfx.deviceContext->PSSetShader(m_gfx.psFloat, NULL, 0);
 			m_gfx.deviceContext->PSSetConstantBuffers(0, 1, &m_gfx.cbFloat);
 		}
 	}
 
-	void Paint()
+	FrameResult RenderDensity(const ViewState& view, int step, const std::function<bool()>& cancelled)
 	{
-		HDC hdc;
-		PAINTSTRUCT ps;
-		hdc = BeginPaint(m_hwnd, &ps);
-		EndPaint(m_hwnd, &ps);
-		EndPaint(m_hwnd, &ps);
-
+		// There is no coarse version of a density pass, the passes themselves refine the image,
+		// and only every few passes are merged and shown. The frame completes once the time limit is reached
+		if (step > 1)
+			return FRAME_PROGRESSIVE;
+		if (!g_densityRenderer.Accumulate(view.dataDouble, view.densityMode, cancelled))
+			return FRAME_CANCELLED;
+		bool finished = g_densityRenderer.IsFinished();
+		if (!finished && !g_densityRenderer.IsDisplayDue())
+			return FRAME_PROGRESSIVE;
 		D3D11_MAPPED_SUBRESOURCE resource;
-		if (SUCCEEDED(m_gfx.deviceContext->Map(m_highPrecision ? m_gfx.cbDouble : m_gfx.cbFloat, 0, D3D11_MAP_WRITE_DISCARD, 0, &resource)))
-		{
-			if (m_highPrecision)
-			{
-				memcpy(resource.pData, &m_dataDouble, sizeof(m_dataDouble));
-				m_gfx.deviceContext->Unmap(m_gfx.cbDouble, 0);
-			}
-			else
-			{
-				memcpy(resource.pData, &m_dataFloat, sizeof(m_dataFloat));
-				m_gfx.deviceContext->Unmap(m_gfx.cbFloat, 0);
-			}
-			m_gfx.deviceContext->Draw(6, 0);
-			m_gfx.swapChain->Present(0, 0);
-		}
-	}
+		if (FAILED(m_gfx.deviceContext->Map(m_gfx.frameTexture, 0, D3D11_MAP_WRITE_DISCARD, 0, &resource)))
+			return FRAME_CANCELLED;
+		g_densityRenderer.Display((BYTE*)resource.pData, resource.RowPitch);
+		m_gfx.deviceContext->Unmap(m_gfx.frameTexture, 0);
+		m_gfx.deviceContext->Draw(6, 0);
+		m_gfx.swapChain->Present(0, 0);
 
-	HWND getHWND()
-	{
-		return m_hwnd;
-	}
-
-	FractalData<float>& getFractalDataFloat()
-	{
-		return m_dataFloat;
-	}
-	FractalData<double>& getFractalDataDouble()
-	{
-		return m_dataDouble;
+		const DensityStats& stats = g_densityRenderer.getStats();
+		WCHAR title[128];
+		swprintf_s(title, L"%s - %s %.2f M escaped orbits/s, %.1f M points sampled, %.1f M escaped", m_name,
+			view.densityMode == DENSITY_NEBULABROT ? L"Nebulabrot" : L"Buddhabrot",
+			stats.orbitsPerSecond / 1e6, stats.samples / 1e6, stats.orbits / 1e6);
+		SetTitle(title);
+		return finished ? FRAME_COMPLETED : FRAME_PROGRESSIVE;
 	}
-};
-
-FractalWindow g_mandelbrot;
-FractalWindow g_julia;
-
-void RedrawRequest(HWND hwnd)
-{
-	InvalidateRect(hwnd, NULL, FALSE);
-}
-void RedrawRequest()
-{
-	InvalidateRect(g_mandelbrot.getHWND(), NULL, FALSE);
-	InvalidateRect(g_julia.getHWND(), NULL, FALSE);
-}
 
-void MouseMove(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
-{
-	static short prevMX = 0;
-	static short prevMY = 0;
-	short mx = LOWORD(lparam);
-	short my = HIWORD(lparam);
-	if (wparam&MK_LBUTTON)
+	FrameResult RenderCpu(const ViewState& view, int step, const std::function<bool()>& cancelled)
 	{
-		if (wparam&MK_CONTROL)
+		if (view.densityMode != DENSITY_OFF)
+			return RenderDensity(view, step, cancelled);
+		D3D11_MAPPED_SUBRESOURCE resource;
+		if (FAILED(m_gfx.deviceContext->Map(m_gfx.frameTexture, 0, D3D11_MAP_WRITE_DISCARD, 0, &resource)))
+			return FRAME_CANCELLED;
+		bool rendered;
+		if (view.highPrecision)
 		{
-			if (hwnd == g_mandelbrot.getHWND())
-			{
-				g_mandelbrot.getFractalDataFloat().setOffset(mx, my);
-				g_mandelbrot.getFractalDataDouble().setOffset(mx, my);
-				g_julia.getFractalDataFloat().offset[0] = g_mandelbrot.getFractalDataFloat().offset[0];
-				g_julia.getFractalDataFloat().offset[1] = g_mandelbrot.getFractalDataFloat().offset[1];
-				g_julia.getFractalDataDouble().offset[0] = g_mandelbrot.getFractalDataDouble().offset[0];
-				g_julia.getFractalDataDouble().offset[1] = g_mandelbrot.getFractalDataDouble().offset[1];
-			}
-			if (hwnd == g_julia.getHWND())
-			{
-				g_julia.getFractalDataFloat().setOffset(mx, my);
-				g_julia.getFractalDataDouble().setOffset(mx, my);
-				g_mandelbrot.getFractalDataFloat().offset[0] = g_julia.getFractalDataFloat().offset[0];
-				g_mandelbrot.getFractalDataFloat().offset[1] = g_julia.getFractalDataFloat().offset[1];
-				g_mandelbrot.getFractalDataDouble().offset[0] = g_julia.getFractalDataDouble().offset[0];
-				g_mandelbrot.getFractalDataDouble().offset[1] = g_julia.getFractalDataDouble().offset[1];
-			}
-			RedrawRequest(g_julia.getHWND());
+			const ReferenceOrbit* orbit = g_orbitCache.Acquire(view.dataDouble, m_isMandelbrot, cancelled);
+			rendered = orbit && g_tileScheduler.Render([&](int x, int y) { return orbit->Iterate(view.dataDouble, x, y); },
+				view.dataDouble.iterCount, step, cancelled, (BYTE*)resource.pData, resource.RowPitch);
 		}
 		else
 		{
-			if (hwnd == g_mandelbrot.getHWND())
-			{
-				g_mandelbrot.getFractalDataFloat().Move(mx - prevMX, my - prevMY);
-				g_mandelbrot.getFractalDataDouble().Move(mx - prevMX, my - prevMY);
-			}
-			if (hwnd == g_julia.getHWND())
-			{
-				g_julia.getFractalDataFloat().Move(mx - prevMX, my - prevMY);
-				g_julia.getFractalDataDouble().Move(mx - prevMX, my - prevMY);
-			}
-			RedrawRequest(hwnd);
-		}
-	}
-	prevMX = mx;
-	prevMY = my;
-}
-void MouseWheel(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
-{
-	double change = (wparam & MK_SHIFT) ? 2.0 : 1.1;
-	if (GET_WHEEL_DELTA_WPARAM(wparam) < 0)
-		change = 1 / change;
-	if (wparam & MK_CONTROL)
-	{
-		if (hwnd == g_mandelbrot.getHWND())
-		{
-			g_mandelbrot.getFractalDataFloat().MulIterCount((float)change);
-			g_mandelbrot.getFractalDataDouble().MulIterCount((double)change);
+			rendered = g_tileScheduler.Render([&](int x, int y) { return view.dataFloat.Iterate(m_isMandelbrot, x, y); },
+				view.dataFloat.iterCount, step, cancelled, (BYTE*)resource.pData, resource.RowPitch);
 		}
-		if (hwnd == g_julia.getHWND())
+		m_gfx.deviceContext->Unmap(m_gfx.frameTexture, 0);
+		if (!rendered)
+			return FRAME_CANCELLED;
+		m_gfx.deviceContext->Draw(6, 0);
+		m_gfx.swapChain->Present(0, 0);
+
+		if (step == 1)
 		{
-			g_julia.getFractalDataFloat().MulIterCount((float)change);
-			g_julia.getFractalDataDouble().MulIterCount((double)change);
+			const SchedulerStats& stats = g_tileScheduler.getStats();
+			WCHAR title[128];
+			swprintf_s(title, L"%s - CPU %.1f ms, %u threads on %u nodes, imbalance %.2f, %u steals",
+				m_name, stats.frameTime, stats.workers, stats.nodes, stats.imbalance, stats.steals);
+			SetTitle(title);
 		}
+		return FRAME_COMPLETED;
 	}
-	else
+
+	FrameResult Render(const ViewState& view, int step, const std::function<bool()>& cancelled)
 	{
-		if (hwnd == g_mandelbrot.getHWND())
+		BindPixelShader(view);
+		if (UsesCpuRendering(view))
+			return RenderCpu(view, step, cancelled);
+		SetTitle(m_name);
+
+		D3D11_MAPPED_SUBRESOURCE resource;
+		if (FAILED(m_gfx.deviceContext->Map(view.highPrecision ? m_gfx.cbDouble : m_gfx.cbFloat, 0, D3D11_MAP_WRITE_DISCARD, 0, &resource)))
+			return FRAME_CANCELLED;
+		if (view.highPrecision)
 		{
-			g_mandelbrot.getFractalDataFloat().Zoom((float)change);
-			g_mandelbrot.getFractalDataDouble().Zoom((double)change);
+			memcpy(resource.pData, &view.dataDouble, sizeof(view.dataDouble));
+			m_gfx.deviceContext->Unmap(m_gfx.cbDouble, 0);
 		}
-		if (hwnd == g_julia.getHWND())
+		else
 		{
-			g_julia.getFractalDataFloat().Zoom((float)change);
-			g_julia.getFractalDataDouble().Zoom((double)change);
+			memcpy(resource.pData, &view.dataFloat, sizeof(view.dataFloat));
+			m_gfx.deviceContext->Unmap(m_gfx.cbFloat, 0);
 		}
+		m_gfx.deviceContext->Draw(6, 0);
+		m_gfx.swapChain->Present(0, 0);
+		return FRAME_COMPLETED;
 	}
-	RedrawRequest(hwnd);
-}
-void RButtonDown(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
-{
-	short mx = LOWORD(lparam);
-	short my = HIWORD(lparam);
-	if (wparam&MK_CONTROL)
+
+	void SetTitle(LPCWSTR title)
 	{
-		if (hwnd == g_mandelbrot.getHWND())
-		{
-			g_mandelbrot.getFractalDataFloat().setOffset(mx, my);
-			g_mandelbrot.getFractalDataDouble().setOffset(mx, my);
-			g_julia.getFractalDataFloat().offset[0] = g_mandelbrot.getFractalDataFloat().offset[0];
-			g_julia.getFractalDataFloat().offset[1] = g_mandelbrot.getFractalDataFloat().offset[1];
-			g_julia.getFractalDataDouble().offset[0] = g_mandelbrot.getFractalDataDouble().offset[0];
-			g_julia.getFractalDataDouble().offset[1] = g_mandelbrot.getFractalDataDouble().offset[1];
-		}
-		if (hwnd == g_julia.getHWND())
+		// Called from the render thread, the window itself is only touched on the UI thread
 		{
-			g_julia.getFractalDataFloat().setOffset(mx, my);
-			g_julia.getFractalDataDouble().setOffset(mx, my);
-			g_mandelbrot.getFractalDataFloat().offset[0] = g_julia.getFractalDataFloat().offset[0];
-			g_mandelbrot.getFractalDataFloat().offset[1] = g_julia.getFractalDataFloat().offset[1];
-			g_mandelbrot.getFractalDataDouble().offset[0] = g_julia.getFractalDataDouble().offset[0];
-			g_mandelbrot.getFractalDataDouble().offset[1] = g_julia.getFractalDataDouble().offset[1];
+			std::lock_guard<std::mutex> lock(m_titleMutex);
+			if (m_title == title)
+				return;
+			m_title = title;
 		}
-		RedrawRequest(g_julia.getHWND());
+		PostMessage(m_hwnd, WM_UPDATE_TITLE, 0, 0);
 	}
-	else
+	void UpdateTitle()
 	{
-		if (hwnd == g_mandelbrot.getHWND())
-		{
-			g_mandelbrot.getFractalDataFloat().setCenter(mx, my);
-			g_mandelbrot.getFractalDataDouble().setCenter(mx, my);
-		}
-		if (hwnd == g_julia.getHWND())
-		{
-			g_julia.getFractalDataFloat().setCenter(mx, my);
-			g_julia.getFractalDataDouble().setCenter(mx, my);
-		}
-		RedrawRequest(hwnd);
+		std::lock_guard<std::mutex> lock(m_titleMutex);
+		SetWindowText(m_hwnd, m_title.c_str());
 	}
-}
-void ResetSettings()
+
+	void RequestRender()
+	{
+		if (m_renderTarget != NO_RENDER_TARGET)
+			g_renderThread.Submit(m_renderTarget, m_view);
+	}
+
+	void Paint()
+	{
+		HDC hdc;
+		PAINTSTRUCT ps;
+		hdc = BeginPaint(m_hwnd, &ps);
+		EndPaint(m_hwnd, &ps);
+		EndPaint(m_hwnd, &ps);
+		RequestRender();
+	}
+
+	HWND getHWND()
+	{
+		return m_hwnd;
+	}
+
+	ViewState& getView()
+	{
+		return m_view;
+	}
+};
+
+FractalWindow g_mandelbrot;
+FractalWindow g_julia;
+
+ViewController g_controller(g_julia.getView(), g_mandelbrot.getView());
+
+void RedrawRequest(unsigned views)
 {
-	g_mandelbrot.ChangePrecision(false);
-	g_mandelbrot.getFractalDataFloat().SetToDefault();
-	g_mandelbrot.getFractalDataDouble().SetToDefault();
-	g_mandelbrot.getFractalDataFloat().center[0] = -0.5f;
-	g_mandelbrot.getFractalDataDouble().center[0] = -0.5;
-	g_julia.ChangePrecision(false);
-	g_julia.getFractalDataFloat().SetToDefault();
-	g_julia.getFractalDataDouble().SetToDefault();
-	RedrawRequest();
+	if (views & (1 << VIEW_MANDELBROT))
+		g_mandelbrot.RequestRender();
+	if (views & (1 << VIEW_JULIA))
+		g_julia.RequestRender();
 }
 
 LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
@@ -679,26 +2147,10 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
 	switch (msg)
 	{
 	case WM_MOUSEMOVE:
-		MouseMove(hwnd, msg, wparam, lparam);
-		return 0;
 	case WM_MOUSEWHEEL:
-		MouseWheel(hwnd, msg, wparam, lparam);
-		return 0;
 	case WM_RBUTTONDOWN:
-		RButtonDown(hwnd, msg, wparam, lparam);
-		return 0;
 	case WM_KEYDOWN:
-		switch (wparam)
-		{
-		case VK_SPACE:
-			g_mandelbrot.SwitchPrecision();
-			g_julia.SwitchPrecision();
-			RedrawRequest();
-			break;
-		case 'R':
-			ResetSettings();
-			break;
-		}
+		RedrawRequest(g_controller.HandleInput(hwnd == g_mandelbrot.getHWND() ? VIEW_MANDELBROT : VIEW_JULIA, msg, wparam, lparam));
 		return 0;
 	case WM_PAINT:
 		if (hwnd == g_mandelbrot.getHWND())
@@ -706,6 +2158,12 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
 		if (hwnd == g_julia.getHWND())
 			g_julia.Paint();
 		return 0;
+	case WM_UPDATE_TITLE:
+		if (hwnd == g_mandelbrot.getHWND())
+			g_mandelbrot.UpdateTitle();
+		if (hwnd == g_julia.getHWND())
+			g_julia.UpdateTitle();
+		return 0;
 	case WM_DESTROY:
 		PostQuitMessage(0);
 		return 0;
@@ -715,6 +2173,9 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
 
 INT WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrecInstance, LPWSTR szCmdLine, INT iCmdShow)
 {
+	if (szCmdLine && wcsstr(szCmdLine, L"/selftest"))
+		return RunSelfTest();
+
 	WNDCLASSEX wc{};
 	wc.style = CS_HREDRAW | CS_VREDRAW | CS_OWNDC;
 	wc.lpfnWndProc = WndProc;
@@ -727,8 +2188,10 @@ INT WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrecInstance, LPWSTR szCmdLi
 	wc.cbSize = sizeof(WNDCLASSEX);
 	RegisterClassEx(&wc);
 
+	g_workerPool.Start();
 	g_mandelbrot.Init(true);
 	g_julia.Init(false);
+	g_renderThread.Start();
 
 	MSG msg{};
 	while (GetMessage(&msg, NULL, 0, 0))
@@ -736,6 +2199,8 @@ INT WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrecInstance, LPWSTR szCmdLi
 		TranslateMessage(&msg);
 		DispatchMessage(&msg);
 	}
+	g_renderThread.Stop();
+	g_workerPool.Stop();
 
 	return (INT)msg.wParam;
 }
\ No newline at end of file